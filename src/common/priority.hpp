@@ -0,0 +1,26 @@
+#pragma once
+
+// Declared by each follower when it connects. The primary serves lower
+// values first.
+enum class FollowerPriority
+{
+  Critical = 0,
+  Normal = 1,
+  Monitoring = 2
+};
+
+constexpr int numFollowerPriorities = 3;
+
+inline const char *followerPriorityName(FollowerPriority priority)
+{
+  switch (priority)
+  {
+  case FollowerPriority::Critical:
+    return "Critical";
+  case FollowerPriority::Normal:
+    return "Normal";
+  case FollowerPriority::Monitoring:
+    return "Monitoring";
+  }
+  return "Unknown";
+}
@@ -0,0 +1,120 @@
+#include "trace.hpp"
+#include <chrono>
+#include <fstream>
+
+const char *traceStageName(TraceStage stage)
+{
+  switch (stage)
+  {
+  case TraceStage::PrimaryDetect:
+    return "primary_detect";
+  case TraceStage::Enqueue:
+    return "enqueue";
+  case TraceStage::WriteComplete:
+    return "write_complete";
+  case TraceStage::SecondaryReceive:
+    return "secondary_receive";
+  case TraceStage::Parse:
+    return "parse";
+  case TraceStage::StudyPickup:
+    return "study_pickup";
+  case TraceStage::OrderReturn:
+    return "order_return";
+  }
+  return "unknown";
+}
+
+TraceBuffer::TraceBuffer(std::size_t capacity) : m_records(capacity) {}
+
+std::int64_t TraceBuffer::now()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+void TraceBuffer::setSampleEvery(unsigned int n)
+{
+  m_sampleEvery.store(n, std::memory_order_relaxed);
+}
+
+bool TraceBuffer::sampled(std::uint64_t seq) const
+{
+  auto n = m_sampleEvery.load(std::memory_order_relaxed);
+  return n != 0 && seq != 0 && seq % n == 0;
+}
+
+void TraceBuffer::record(std::uint64_t seq, TraceStage stage,
+                         std::int64_t timestamp, std::uint16_t follower)
+{
+  if (!sampled(seq) || m_records.empty())
+    return;
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_records[m_next] = {timestamp, static_cast<std::uint32_t>(seq), stage,
+                       follower};
+  if (++m_next == m_records.size())
+  {
+    m_next = 0;
+    m_wrapped = true;
+  }
+}
+
+std::vector<TraceRecord> TraceBuffer::snapshot() const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  std::vector<TraceRecord> result;
+  if (m_wrapped)
+  {
+    result.assign(m_records.begin() + m_next, m_records.end());
+  }
+  result.insert(result.end(), m_records.begin(), m_records.begin() + m_next);
+  return result;
+}
+
+void TraceBuffer::write(std::ostream &os, TraceFormat format,
+                        const char *processName) const
+{
+  auto records = snapshot();
+  bool first = true;
+  if (format == TraceFormat::Chrome)
+  {
+    // Instant events, one row per sequence number so each update reads left
+    // to right across its stages
+    os << "{\"traceEvents\":[{\"name\":\"process_name\",\"ph\":\"M\","
+          "\"pid\":0,\"args\":{\"name\":\""
+       << processName << "\"}}";
+    for (auto const &r : records)
+    {
+      os << ",\n{\"name\":\"" << traceStageName(r.stage)
+         << "\",\"ph\":\"i\",\"s\":\"t\",\"pid\":0,\"tid\":" << r.seq
+         << ",\"ts\":" << r.timestamp;
+      if (r.follower != 0)
+        os << ",\"args\":{\"follower\":" << r.follower << "}";
+      os << "}";
+    }
+    os << "]}\n";
+  }
+  else
+  {
+    os << "[";
+    for (auto const &r : records)
+    {
+      os << (first ? "\n" : ",\n") << "{\"process\":\"" << processName
+         << "\",\"seq\":" << r.seq << ",\"stage\":\""
+         << traceStageName(r.stage) << "\",\"ts\":" << r.timestamp
+         << ",\"follower\":" << r.follower << "}";
+      first = false;
+    }
+    os << "]\n";
+  }
+}
+
+bool TraceBuffer::writeFile(std::string const &path, TraceFormat format,
+                            const char *processName) const
+{
+  std::ofstream file(path, std::ios::out | std::ios::trunc);
+  if (!file)
+    return false;
+  write(file, format, processName);
+  return bool(file);
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Stages a position update passes through on its way from the primary to an
+// order on the secondary, in the order they happen.
+enum class TraceStage : std::uint8_t
+{
+  PrimaryDetect = 0,
+  Enqueue,
+  WriteComplete,
+  SecondaryReceive,
+  Parse,
+  StudyPickup,
+  OrderReturn,
+};
+
+enum class TraceFormat
+{
+  Chrome = 0,
+  Json = 1
+};
+
+const char *traceStageName(TraceStage stage);
+
+struct TraceRecord
+{
+  // Microseconds since the epoch so records from both instances line up
+  std::int64_t timestamp;
+  std::uint32_t seq;
+  TraceStage stage;
+  // Primary connection the record belongs to, zero when it is not specific
+  // to one follower
+  std::uint16_t follower;
+};
+static_assert(sizeof(TraceRecord) == 16, "TraceRecord should stay compact");
+
+// Fixed size ring of stage timestamps keyed by position update sequence
+// number. Sampling is decided by sequence number alone, so a primary and a
+// secondary with the same sample rate trace the same updates.
+class TraceBuffer
+{
+public:
+  explicit TraceBuffer(std::size_t capacity = 1 << 16);
+
+  static std::int64_t now();
+
+  // Trace every nth update, or nothing when n is zero
+  void setSampleEvery(unsigned int n);
+  bool sampled(std::uint64_t seq) const;
+
+  void record(std::uint64_t seq, TraceStage stage)
+  {
+    record(seq, stage, now());
+  }
+  void record(std::uint64_t seq, TraceStage stage, std::int64_t timestamp,
+              std::uint16_t follower = 0);
+
+  // Records oldest first
+  std::vector<TraceRecord> snapshot() const;
+  void write(std::ostream &os, TraceFormat format,
+             const char *processName) const;
+  bool writeFile(std::string const &path, TraceFormat format,
+                 const char *processName) const;
+
+private:
+  std::atomic<unsigned int> m_sampleEvery{0};
+  mutable std::mutex m_mutex;
+  std::vector<TraceRecord> m_records;
+  std::size_t m_next = 0;
+  bool m_wrapped = false;
+};
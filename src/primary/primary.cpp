@@ -1,4 +1,5 @@
 #include "primary.hpp"
+#include "primary_plugin.hpp"
 #include "boost/asio.hpp"
 #include "boost/asio/deadline_timer.hpp"
 #include "boost/asio/dispatch.hpp"
@@ -26,181 +27,15 @@ namespace boost
 void tss_cleanup_implemented() {}
 } // namespace boost
 
-using tcp = boost::asio::ip::tcp;
-using boost::asio::io_service;
+const char *hello_primary() { return "world"; }
 
-struct Connection
+enum class DetectionMode
 {
-  explicit Connection(tcp::socket socket) : m_socket(std::move(socket))
-  {
-    boost::system::error_code ec;
-    auto endpoint = m_socket.remote_endpoint(ec);
-    if (!ec)
-    {
-      BOOST_LOG_TRIVIAL(info) << "New connection from " << endpoint;
-    }
-    else
-    {
-      BOOST_LOG_TRIVIAL(error)
-          << "Unable to get remote endpoint from socket! " << ec.message();
-    }
-  }
-
-  tcp::socket &socket() { return m_socket; }
-
-private:
-  tcp::socket m_socket;
+  ChartUpdates = 0,
+  TradeNotifications = 1,
+  Continuous = 2
 };
 
-struct PrimaryPlugin
-{
-  explicit PrimaryPlugin(std::string chartbookName, unsigned int port)
-      : m_chartbookName(chartbookName), m_port(port), m_work(m_service),
-        m_endpoint(tcp::v4(), port), m_acceptor(m_service, m_endpoint),
-        m_thread(std::bind(&PrimaryPlugin::threadFunc, this)),
-        m_timer(m_service)
-  {
-    BOOST_LOG_TRIVIAL(info)
-        << "Creating new primary server on port " << this->port();
-    sendPing();
-  }
-
-  ~PrimaryPlugin()
-  {
-    BOOST_LOG_TRIVIAL(info)
-        << "Stopping primary server on port " << this->port();
-    m_service.stop();
-
-    try
-    {
-      BOOST_LOG_TRIVIAL(info) << "Joining thread";
-      if (m_thread.joinable())
-        m_thread.join();
-    }
-    catch (...)
-    {
-      BOOST_LOG_TRIVIAL(error) << "Exception when joining thread";
-    }
-  }
-
-  unsigned int port() const { return m_port; }
-
-  void processPosition(t_OrderQuantity32_64 position)
-  {
-    if (position != m_position)
-    {
-      m_position = position;
-      sendPosition();
-    }
-  }
-
-  unsigned int numClients() const { return m_connections.size(); }
-
-private:
-  void sendMessage(boost::json::object msg)
-  {
-    msg["cb"] = m_chartbookName;
-    const auto json = boost::json::serialize(msg) + "\n";
-    for (auto &conn : m_connections)
-    {
-      if (conn->socket().is_open())
-      {
-        boost::asio::async_write(conn->socket(), boost::asio::buffer(json),
-                                 makeCompletionHandler(*conn));
-      }
-    }
-  }
-
-  void sendPosition() { sendMessage({{"position", m_position}}); }
-
-  void sendPing()
-  {
-    auto end = std::remove_if(m_connections.begin(), m_connections.end(),
-                              [](std::unique_ptr<Connection> &conn) {
-                                return !conn->socket().is_open();
-                              });
-    m_connections.erase(end, m_connections.end());
-    auto tick = boost::posix_time::second_clock::local_time();
-    if (tick.time_of_day().seconds() % 5 == 0)
-    {
-      BOOST_LOG_TRIVIAL(info) << m_connections.size() << " clients connected";
-    }
-    boost::json::object msg = {
-        {"ping", boost::posix_time::to_iso_string(tick)},
-    };
-
-    sendMessage(msg);
-
-    m_timer.expires_after(boost::asio::chrono::seconds(1));
-    m_timer.async_wait(
-        [this](const boost::system::error_code &) { sendPing(); });
-  }
-
-  std::function<void(boost::system::error_code const &ec, std::size_t)>
-  makeCompletionHandler(Connection &conn)
-  {
-    return [&conn](boost::system::error_code const &ec, std::size_t) {
-      if (ec)
-      {
-        BOOST_LOG_TRIVIAL(error) << "Error, closing socket: " << ec;
-        boost::system::error_code ec2;
-        conn.socket().close(ec2);
-      }
-    };
-  }
-
-  void accept()
-  {
-    m_acceptor.async_accept(
-        [this](boost::system::error_code ec, tcp::socket socket) {
-          if (!ec)
-          {
-            m_connections.push_back(
-                std::make_unique<Connection>(std::move(socket)));
-          }
-          sendPosition();
-          accept();
-        });
-  }
-
-  void threadFunc()
-  {
-    BOOST_LOG_TRIVIAL(info) << "Starting thread";
-
-    while (!m_service.stopped())
-    {
-      try
-      {
-        accept();
-        m_service.run();
-      }
-      catch (std::exception const &e)
-      {
-        BOOST_LOG_TRIVIAL(error)
-            << "Exception in io_service::run: " << e.what();
-      }
-      catch (...)
-      {
-        BOOST_LOG_TRIVIAL(error) << "Unknown exception in io_service::run";
-      }
-    }
-    BOOST_LOG_TRIVIAL(info) << "Thread done";
-  }
-
-  t_OrderQuantity32_64 m_position = 0;
-  std::string m_chartbookName;
-  unsigned int m_port;
-  boost::asio::io_service m_service;
-  boost::asio::io_service::work m_work;
-  tcp::endpoint m_endpoint;
-  tcp::acceptor m_acceptor;
-  std::vector<std::unique_ptr<Connection>> m_connections;
-  std::thread m_thread;
-  boost::asio::steady_timer m_timer;
-};
-
-const char *hello_primary() { return "world"; }
-
 SCSFExport scsf_PrimaryInstance(SCStudyInterfaceRef sc)
 {
 
@@ -214,6 +49,15 @@ SCSFExport scsf_PrimaryInstance(SCStudyInterfaceRef sc)
   SCInputRef Input_TransparentLabelBackground = sc.Input[5];
   SCInputRef Input_TextSize = sc.Input[6];
 
+  SCInputRef Input_TraceEvery = sc.Input[7];
+  SCInputRef Input_TraceFormat = sc.Input[8];
+  SCInputRef Input_TracePath = sc.Input[9];
+  SCInputRef Input_TraceExport = sc.Input[10];
+
+  SCInputRef Input_LaggardThreshold = sc.Input[11];
+
+  SCInputRef Input_DetectionMode = sc.Input[12];
+
   try
   {
     if (sc.SetDefaults)
@@ -263,6 +107,36 @@ SCSFExport scsf_PrimaryInstance(SCStudyInterfaceRef sc)
 
       Input_TransparentLabelBackground.Name = "Transparent Label Background";
       Input_TransparentLabelBackground.SetYesNo(false);
+
+      Input_TraceEvery.Name = "Trace every Nth position update (0 = off)";
+      Input_TraceEvery.SetInt(0);
+      Input_TraceEvery.SetIntLimits(0, 1000000);
+
+      Input_TraceFormat.Name = "Trace export format";
+      Input_TraceFormat.SetCustomInputStrings("Chrome trace;JSON");
+      Input_TraceFormat.SetCustomInputIndex(0);
+
+      Input_TracePath.Name = "Trace export file";
+      Input_TracePath.SetString("position_copy_primary_trace.json");
+
+      Input_TraceExport.Name = "Export trace now";
+      Input_TraceExport.SetYesNo(false);
+
+      Input_LaggardThreshold.Name = "Laggard threshold (ms)";
+      Input_LaggardThreshold.SetInt(1000);
+      Input_LaggardThreshold.SetIntLimits(0, 3600000);
+      Input_LaggardThreshold.SetDescription(
+          "Followers taking longer than this to reach the primary position "
+          "are listed as laggards");
+
+      Input_DetectionMode.Name = "Position detection";
+      Input_DetectionMode.SetCustomInputStrings(
+          "Chart updates;Trade/order notifications;Continuous updates");
+      Input_DetectionMode.SetCustomInputIndex(1);
+      Input_DetectionMode.SetDescription(
+          "Chart updates only notice fills when the chart ticks. Notifications "
+          "run the study on every order and position change. Continuous "
+          "updates run it at the chart update interval.");
     }
     else
     {
@@ -274,13 +148,64 @@ SCSFExport scsf_PrimaryInstance(SCStudyInterfaceRef sc)
         sc.SetPersistentPointer(1, ptr);
         sc.AddMessageToLog("Started server", 0);
       }
+      ptr->trace().setSampleEvery(Input_TraceEvery.GetInt());
+      ptr->setLaggardThreshold(Input_LaggardThreshold.GetInt());
+      if (Input_TraceExport.GetYesNo())
+      {
+        Input_TraceExport.SetYesNo(false);
+        auto format = static_cast<TraceFormat>(Input_TraceFormat.GetIndex());
+        if (ptr->trace().writeFile(Input_TracePath.GetString(), format,
+                                   "primary"))
+          sc.AddMessageToLog("Exported trace", 0);
+        else
+          sc.AddMessageToLog("Unable to export trace", 1);
+      }
       s_SCPositionData position;
+      // Without these the study only runs on a chart tick, so on a quiet
+      // instrument a fill can sit unpublished until the market moves
+      auto detectionMode =
+          static_cast<DetectionMode>(Input_DetectionMode.GetIndex());
+      sc.ReceiveNotificationsForChangesToOrdersPositionsForAnySymbol =
+          detectionMode == DetectionMode::TradeNotifications;
+      sc.UpdateAlways = detectionMode == DetectionMode::Continuous;
+
       sc.GetTradePosition(position);
-      ptr->processPosition(position.PositionQuantity);
+      boost::posix_time::time_duration fillAge;
+      if (position.LastFillDateTime.GetAsDouble() > 0)
+      {
+        const double millisecondsPerDay = 24 * 60 * 60 * 1000.0;
+        auto ageMs = (sc.CurrentSystemDateTimeMS.GetAsDouble() -
+                      position.LastFillDateTime.GetAsDouble()) *
+                     millisecondsPerDay;
+        fillAge = boost::posix_time::milliseconds(
+            static_cast<long long>(std::max(0.0, ageMs)));
+      }
+      ptr->processPosition(position.PositionQuantity, fillAge);
 
       SCString ServerInfo;
-      ServerInfo.Format("Port: %d NumClients: %d", ptr->port(),
-                        ptr->numClients());
+      ServerInfo.Format(
+          "Port: %d NumClients: %d Fill to publish: %d ms (max %d ms)",
+          ptr->port(), ptr->numClients(),
+          (int)ptr->lastFillToPublish().total_milliseconds(),
+          (int)ptr->maxFillToPublish().total_milliseconds());
+      auto tiers = ptr->tierLatencies();
+      for (int i = 0; i < numFollowerPriorities; ++i)
+      {
+        if (tiers[i].count == 0)
+          continue;
+        SCString TierInfo;
+        TierInfo.Format(" %s: %d/%d us",
+                        followerPriorityName(static_cast<FollowerPriority>(i)),
+                        (int)tiers[i].last.total_microseconds(),
+                        (int)tiers[i].max.total_microseconds());
+        ServerInfo += TierInfo;
+      }
+      auto laggards = ptr->laggards();
+      if (!laggards.empty())
+      {
+        ServerInfo += " Laggards:";
+        ServerInfo += laggards.c_str();
+      }
 
       int HorizontalPosition = Input_HorizontalPosition.GetInt();
       int VerticalPosition = Input_VerticalPosition.GetInt();
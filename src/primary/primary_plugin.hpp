@@ -0,0 +1,617 @@
+#pragma once
+
+#include "priority.hpp"
+#include "trace.hpp"
+#include "boost/asio.hpp"
+#include "boost/asio/io_service.hpp"
+#include "boost/asio/post.hpp"
+#include "boost/asio/read_until.hpp"
+#include "boost/asio/steady_timer.hpp"
+#include "boost/asio/write.hpp"
+#include "boost/date_time/posix_time/posix_time_types.hpp"
+#include "boost/date_time/posix_time/time_formatters.hpp"
+#include "boost/json/object.hpp"
+#include "boost/json/parse.hpp"
+#include "boost/json/serialize.hpp"
+#include "boost/log/trivial.hpp"
+#include "sierrachart.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using tcp = boost::asio::ip::tcp;
+
+// Last state reported back by a follower over its connection
+struct FollowerState
+{
+  bool hasFeedback = false;
+  t_OrderQuantity32_64 position = 0;
+  bool workingOrders = false;
+  std::uint64_t convergedSeq = 0;
+  // Time from publishing an update until the follower reported reaching it
+  boost::posix_time::time_duration lastConvergeTime;
+  boost::posix_time::time_duration maxConvergeTime;
+};
+
+struct OutgoingMessage
+{
+  // Shared by every follower's queue so it outlives the last write
+  std::shared_ptr<const std::string> json;
+  std::uint64_t seq;
+  bool isPosition;
+  boost::posix_time::ptime enqueued;
+};
+
+struct TierLatency
+{
+  std::uint64_t count = 0;
+  // Time from enqueueing a position update until its write completed
+  boost::posix_time::time_duration last;
+  boost::posix_time::time_duration max;
+};
+
+struct Connection
+{
+  Connection(tcp::socket socket, std::uint16_t id)
+      : m_socket(std::move(socket)), m_id(id)
+  {
+    boost::system::error_code ec;
+    auto endpoint = m_socket.remote_endpoint(ec);
+    if (!ec)
+    {
+      BOOST_LOG_TRIVIAL(info)
+          << "New connection from " << endpoint << " (follower " << id << ")";
+      std::ostringstream oss;
+      oss << endpoint;
+      m_name = oss.str();
+    }
+    else
+    {
+      BOOST_LOG_TRIVIAL(error)
+          << "Unable to get remote endpoint from socket! " << ec.message();
+      m_name = "unknown";
+    }
+  }
+
+  tcp::socket &socket() { return m_socket; }
+  // Identifies the follower in trace records
+  std::uint16_t id() const { return m_id; }
+  std::string const &name() const { return m_name; }
+  std::string &buffer() { return m_buffer; }
+  FollowerState &state() { return m_state; }
+  FollowerPriority priority() const { return m_priority; }
+  void setPriority(FollowerPriority priority) { m_priority = priority; }
+
+  static constexpr std::size_t maxQueued = 1024;
+
+  // Queues `out` behind anything not yet written. Returns false when the
+  // follower has fallen too far behind to keep.
+  bool push(OutgoingMessage const &out)
+  {
+    if (m_priority == FollowerPriority::Monitoring)
+    {
+      // Monitoring clients only care about the latest state, so anything of
+      // the same kind still waiting to be written is superseded
+      m_queue.erase(std::remove_if(m_queue.begin(), m_queue.end(),
+                                   [&](OutgoingMessage const &queued) {
+                                     return queued.isPosition ==
+                                            out.isPosition;
+                                   }),
+                    m_queue.end());
+    }
+    else if (m_queue.size() >= maxQueued)
+    {
+      return false;
+    }
+    m_queue.push_back(out);
+    return true;
+  }
+
+  OutgoingMessage pop()
+  {
+    auto out = std::move(m_queue.front());
+    m_queue.pop_front();
+    return out;
+  }
+
+  std::size_t queued() const { return m_queue.size(); }
+  bool writing() const { return m_writing; }
+  void setWriting(bool writing) { m_writing = writing; }
+
+private:
+  tcp::socket m_socket;
+  std::uint16_t m_id;
+  std::string m_name;
+  std::string m_buffer;
+  FollowerPriority m_priority = FollowerPriority::Normal;
+  std::deque<OutgoingMessage> m_queue;
+  bool m_writing = false;
+  FollowerState m_state;
+};
+
+struct PrimaryPlugin
+{
+  explicit PrimaryPlugin(std::string chartbookName, unsigned int port)
+      : m_chartbookName(chartbookName), m_port(port), m_work(m_service),
+        m_endpoint(tcp::v4(), port), m_acceptor(m_service, m_endpoint),
+        m_thread(std::bind(&PrimaryPlugin::threadFunc, this)),
+        m_timer(m_service)
+  {
+    BOOST_LOG_TRIVIAL(info)
+        << "Creating new primary server on port " << this->port();
+    // m_connections belongs to the io thread, which may already be accepting
+    boost::asio::post(m_service, [this]() { sendPing(); });
+  }
+
+  ~PrimaryPlugin()
+  {
+    BOOST_LOG_TRIVIAL(info)
+        << "Stopping primary server on port " << this->port();
+    m_service.stop();
+
+    try
+    {
+      BOOST_LOG_TRIVIAL(info) << "Joining thread";
+      if (m_thread.joinable())
+        m_thread.join();
+    }
+    catch (...)
+    {
+      BOOST_LOG_TRIVIAL(error) << "Exception when joining thread";
+    }
+  }
+
+  unsigned int port() const { return m_port; }
+
+  // `fillAge` is how long before this call the fill behind the position
+  // happened, as far as the study can tell
+  void processPosition(t_OrderQuantity32_64 position,
+                       boost::posix_time::time_duration fillAge = {})
+  {
+    const auto detected = TraceBuffer::now();
+    const auto detectedAt = boost::posix_time::microsec_clock::universal_time();
+    boost::asio::post(m_service, [this, position, detected, detectedAt,
+                                  fillAge]() {
+      // The first observation just picks up whatever position was open when
+      // the study started, its fill may be hours old
+      const bool initial = !m_seenInitialPosition;
+      m_seenInitialPosition = true;
+      if (position != m_position)
+      {
+        m_position = position;
+        ++m_seq;
+        m_trace.record(m_seq, TraceStage::PrimaryDetect, detected);
+        m_publishTimes[m_seq] =
+            boost::posix_time::microsec_clock::universal_time();
+        while (m_publishTimes.size() > 1024)
+          m_publishTimes.erase(m_publishTimes.begin());
+        sendPosition();
+
+        if (initial)
+          return;
+        auto latency = fillAge +
+                       (boost::posix_time::microsec_clock::universal_time() -
+                        detectedAt);
+        BOOST_LOG_TRIVIAL(info)
+            << "Published position " << m_position << " seq " << m_seq
+            << " fill to publish " << latency.total_milliseconds() << " ms";
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_lastFillToPublish = latency;
+        m_maxFillToPublish = std::max(m_maxFillToPublish, latency);
+      }
+    });
+  }
+
+  unsigned int numClients() const { return m_numClients; }
+
+  TraceBuffer &trace() { return m_trace; }
+
+  void setLaggardThreshold(int milliseconds)
+  {
+    m_laggardThresholdMs = milliseconds;
+  }
+
+  std::string laggards()
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_laggards;
+  }
+
+  boost::posix_time::time_duration lastFillToPublish()
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_lastFillToPublish;
+  }
+
+  boost::posix_time::time_duration maxFillToPublish()
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_maxFillToPublish;
+  }
+
+  // Followers' priorities in the order they are written to
+  std::vector<FollowerPriority> priorities()
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_priorities;
+  }
+
+  unsigned short localPort() const
+  {
+    boost::system::error_code ec;
+    return m_acceptor.local_endpoint(ec).port();
+  }
+
+  std::array<TierLatency, numFollowerPriorities> tierLatencies()
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_tierLatency;
+  }
+
+private:
+  // `seq` is the update being traced by this message, or zero
+  OutgoingMessage makeMessage(boost::json::object msg, std::uint64_t seq)
+  {
+    msg["cb"] = m_chartbookName;
+    return {std::make_shared<const std::string>(boost::json::serialize(msg) +
+                                                "\n"),
+            seq, msg.contains("position"),
+            boost::posix_time::microsec_clock::universal_time()};
+  }
+
+  void sendMessage(boost::json::object msg, std::uint64_t seq = 0)
+  {
+    auto out = makeMessage(std::move(msg), seq);
+    m_trace.record(seq, TraceStage::Enqueue);
+    // m_connections is kept sorted by priority, so the most important
+    // followers have their writes started first
+    for (auto &conn : m_connections)
+    {
+      if (conn->socket().is_open())
+      {
+        enqueue(conn, out);
+      }
+    }
+  }
+
+  void enqueue(std::shared_ptr<Connection> const &conn,
+               OutgoingMessage const &out)
+  {
+    if (!conn->push(out))
+    {
+      BOOST_LOG_TRIVIAL(error)
+          << "Closing socket, " << conn->name() << " is not keeping up";
+      boost::system::error_code ec;
+      conn->socket().close(ec);
+      return;
+    }
+    writeNext(conn);
+  }
+
+  void writeNext(std::shared_ptr<Connection> conn)
+  {
+    if (conn->writing() || conn->queued() == 0)
+      return;
+    conn->setWriting(true);
+    auto out = conn->pop();
+    auto buffer = boost::asio::buffer(*out.json);
+    boost::asio::async_write(
+        conn->socket(), buffer,
+        [this, conn, out = std::move(out)](boost::system::error_code const &ec,
+                                           std::size_t) {
+          conn->setWriting(false);
+          if (ec)
+          {
+            BOOST_LOG_TRIVIAL(error) << "Error, closing socket: " << ec;
+            boost::system::error_code ec2;
+            conn->socket().close(ec2);
+            return;
+          }
+          m_trace.record(out.seq, TraceStage::WriteComplete,
+                         TraceBuffer::now(), conn->id());
+          // Replays to newly connected followers carry no seq and would
+          // skew the tiers with connect bursts
+          if (out.isPosition && out.seq != 0)
+          {
+            recordDelivery(conn->priority(),
+                           boost::posix_time::microsec_clock::universal_time() -
+                               out.enqueued);
+          }
+          writeNext(conn);
+        });
+  }
+
+  void recordDelivery(FollowerPriority priority,
+                      boost::posix_time::time_duration latency)
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto &tier = m_tierLatency[static_cast<int>(priority)];
+    ++tier.count;
+    tier.last = latency;
+    tier.max = std::max(tier.max, latency);
+  }
+
+  void sortConnections()
+  {
+    std::stable_sort(m_connections.begin(), m_connections.end(),
+                     [](std::shared_ptr<Connection> const &a,
+                        std::shared_ptr<Connection> const &b) {
+                       return a->priority() < b->priority();
+                     });
+    std::vector<FollowerPriority> priorities;
+    for (auto &conn : m_connections)
+      priorities.push_back(conn->priority());
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_priorities = std::move(priorities);
+  }
+
+  boost::json::object positionMessage() const
+  {
+    return {{"position", m_position}, {"seq", m_seq}, {"session", m_session}};
+  }
+
+  void sendPosition() { sendMessage(positionMessage(), m_seq); }
+
+  void sendPing()
+  {
+    auto end = std::remove_if(m_connections.begin(), m_connections.end(),
+                              [](std::shared_ptr<Connection> &conn) {
+                                return !conn->socket().is_open();
+                              });
+    m_connections.erase(end, m_connections.end());
+    sortConnections();
+    m_numClients = m_connections.size();
+    auto tick = boost::posix_time::second_clock::local_time();
+    updateLaggards();
+    if (tick.time_of_day().seconds() % 5 == 0)
+    {
+      BOOST_LOG_TRIVIAL(info) << m_connections.size() << " clients connected";
+      logFollowers();
+    }
+    boost::json::object msg = {
+        {"ping", boost::posix_time::to_iso_string(tick)},
+    };
+
+    sendMessage(msg);
+
+    m_timer.expires_after(boost::asio::chrono::seconds(1));
+    m_timer.async_wait(
+        [this](const boost::system::error_code &) { sendPing(); });
+  }
+
+  void readNext(std::shared_ptr<Connection> conn)
+  {
+    boost::asio::async_read_until(
+        conn->socket(), boost::asio::dynamic_buffer(conn->buffer()), '\n',
+        [this, conn](const boost::system::error_code &ec,
+                     std::size_t bytesRead) {
+          if (ec)
+          {
+            if (ec != boost::asio::error::operation_aborted)
+            {
+              BOOST_LOG_TRIVIAL(error)
+                  << "Closing socket due to read error: " << ec;
+            }
+            boost::system::error_code ec2;
+            conn->socket().close(ec2);
+            return;
+          }
+          try
+          {
+            auto line = conn->buffer().substr(0, bytesRead - 1);
+            conn->buffer().erase(0, bytesRead);
+            BOOST_LOG_TRIVIAL(trace)
+                << "Received from " << conn->name() << ": " << line;
+            processFeedback(*conn, boost::json::parse(line));
+          }
+          catch (std::exception const &e)
+          {
+            BOOST_LOG_TRIVIAL(error) << "Exception: " << e.what();
+          }
+          readNext(conn);
+        });
+  }
+
+  void processFeedback(Connection &conn, boost::json::value const &jv)
+  {
+    auto p = jv.if_object();
+    if (!p)
+      return;
+
+    if (auto priority = p->if_contains("priority"))
+    {
+      auto value = std::min<std::int64_t>(
+          std::max<std::int64_t>(priority->to_number<std::int64_t>(), 0),
+          numFollowerPriorities - 1);
+      conn.setPriority(static_cast<FollowerPriority>(value));
+      BOOST_LOG_TRIVIAL(info) << "Follower " << conn.name() << " priority "
+                              << followerPriorityName(conn.priority());
+      sortConnections();
+      return;
+    }
+
+    // Sequence numbers restart with every new server, so a report about an
+    // earlier one (resent on reconnect, say) says nothing about this one
+    auto session = p->if_contains("session");
+    if (!session || session->to_number<std::int64_t>() != m_session)
+      return;
+
+    auto &state = conn.state();
+    state.hasFeedback = true;
+    if (auto position = p->if_contains("position"))
+      state.position = position->to_number<double>();
+    if (auto working = p->if_contains("working"))
+      state.workingOrders = working->as_bool();
+    if (auto converged = p->if_contains("converged"))
+    {
+      auto seq = converged->to_number<std::uint64_t>();
+      if (seq > state.convergedSeq)
+      {
+        state.convergedSeq = seq;
+        auto published = m_publishTimes.find(seq);
+        if (published != m_publishTimes.end())
+        {
+          state.lastConvergeTime =
+              boost::posix_time::microsec_clock::universal_time() -
+              published->second;
+          state.maxConvergeTime =
+              std::max(state.maxConvergeTime, state.lastConvergeTime);
+        }
+      }
+    }
+    updateLaggards();
+  }
+
+  // How long the follower has been behind the latest published update
+  boost::posix_time::time_duration pendingLag(FollowerState const &state,
+                                              boost::posix_time::ptime now)
+  {
+    if (state.convergedSeq >= m_seq)
+      return {};
+    auto oldest = m_publishTimes.upper_bound(state.convergedSeq);
+    if (oldest == m_publishTimes.end())
+      return {};
+    return now - oldest->second;
+  }
+
+  void updateLaggards()
+  {
+    auto now = boost::posix_time::microsec_clock::universal_time();
+    auto threshold =
+        boost::posix_time::milliseconds(m_laggardThresholdMs.load());
+    std::ostringstream oss;
+    for (auto &conn : m_connections)
+    {
+      auto &state = conn->state();
+      if (!conn->socket().is_open() || !state.hasFeedback)
+        continue;
+      auto lag = std::max(pendingLag(state, now), state.lastConvergeTime);
+      if (lag > threshold)
+      {
+        oss << " " << conn->name() << " (" << lag.total_milliseconds()
+            << " ms)";
+      }
+    }
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_laggards = oss.str();
+  }
+
+  void logFollowers()
+  {
+    auto tiers = tierLatencies();
+    for (int i = 0; i < numFollowerPriorities; ++i)
+    {
+      if (tiers[i].count == 0)
+        continue;
+      BOOST_LOG_TRIVIAL(info)
+          << followerPriorityName(static_cast<FollowerPriority>(i))
+          << " delivery latency last " << tiers[i].last.total_microseconds()
+          << " us max " << tiers[i].max.total_microseconds() << " us over "
+          << tiers[i].count << " writes";
+    }
+
+    auto now = boost::posix_time::microsec_clock::universal_time();
+    for (auto &conn : m_connections)
+    {
+      auto &state = conn->state();
+      if (!state.hasFeedback)
+        continue;
+      BOOST_LOG_TRIVIAL(info)
+          << "Follower " << conn->name() << " ("
+          << followerPriorityName(conn->priority()) << ") position "
+          << state.position << " working " << state.workingOrders
+          << " converged " << state.convergedSeq << "/" << m_seq
+          << " last converge "
+          << state.lastConvergeTime.total_milliseconds() << " ms max "
+          << state.maxConvergeTime.total_milliseconds() << " ms behind "
+          << pendingLag(state, now).total_milliseconds() << " ms";
+    }
+  }
+
+  void accept()
+  {
+    m_acceptor.async_accept(
+        [this](boost::system::error_code ec, tcp::socket socket) {
+          if (!ec)
+          {
+            // Zero is reserved for records not tied to a follower
+            if (++m_nextConnectionId == 0)
+              ++m_nextConnectionId;
+            auto conn = std::make_shared<Connection>(std::move(socket),
+                                                     m_nextConnectionId);
+            m_connections.push_back(conn);
+            sortConnections();
+            m_numClients = m_connections.size();
+            readNext(conn);
+            // Bring the new follower up to date. This is a replay rather
+            // than a publish, so it is not traced here and is marked so the
+            // follower does not trace it either.
+            auto msg = positionMessage();
+            msg["replay"] = true;
+            enqueue(conn, makeMessage(std::move(msg), 0));
+          }
+          accept();
+        });
+  }
+
+  void threadFunc()
+  {
+    BOOST_LOG_TRIVIAL(info) << "Starting thread";
+
+    while (!m_service.stopped())
+    {
+      try
+      {
+        accept();
+        m_service.run();
+      }
+      catch (std::exception const &e)
+      {
+        BOOST_LOG_TRIVIAL(error)
+            << "Exception in io_service::run: " << e.what();
+      }
+      catch (...)
+      {
+        BOOST_LOG_TRIVIAL(error) << "Unknown exception in io_service::run";
+      }
+    }
+    BOOST_LOG_TRIVIAL(info) << "Thread done";
+  }
+
+  t_OrderQuantity32_64 m_position = 0;
+  // Sequence number of the last position change, carried in every position
+  // message so each update can be followed through both instances
+  std::uint64_t m_seq = 0;
+  bool m_seenInitialPosition = false;
+  // Identifies this server instance so followers can tell its sequence
+  // numbers apart from those of a previous one
+  const std::int64_t m_session = TraceBuffer::now();
+  std::map<std::uint64_t, boost::posix_time::ptime> m_publishTimes;
+  TraceBuffer m_trace;
+  std::mutex m_mutex;
+  std::string m_laggards;
+  boost::posix_time::time_duration m_lastFillToPublish;
+  boost::posix_time::time_duration m_maxFillToPublish;
+  std::array<TierLatency, numFollowerPriorities> m_tierLatency;
+  std::vector<FollowerPriority> m_priorities;
+  std::atomic<unsigned int> m_numClients{0};
+  std::atomic<int> m_laggardThresholdMs{1000};
+  std::string m_chartbookName;
+  unsigned int m_port;
+  boost::asio::io_service m_service;
+  boost::asio::io_service::work m_work;
+  tcp::endpoint m_endpoint;
+  tcp::acceptor m_acceptor;
+  std::vector<std::shared_ptr<Connection>> m_connections;
+  std::uint16_t m_nextConnectionId = 0;
+  std::thread m_thread;
+  boost::asio::steady_timer m_timer;
+};
@@ -0,0 +1,91 @@
+#include "io_loop.hpp"
+#include "boost/log/trivial.hpp"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#endif
+
+bool pinCurrentThread(int core)
+{
+  if (core < 0)
+    return true;
+#ifdef _WIN32
+  if (core >= int(sizeof(DWORD_PTR) * 8))
+    return false;
+  return SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << core) != 0;
+#else
+  if (core >= CPU_SETSIZE)
+    return false;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(core, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#endif
+}
+
+double currentThreadCpuSeconds()
+{
+#ifdef _WIN32
+  FILETIME creation, exit, kernel, user;
+  if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+    return 0;
+  auto ticks = [](FILETIME const &ft) {
+    return (ULONGLONG(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+  };
+  // FILETIME is in 100ns units
+  return (ticks(kernel) + ticks(user)) * 1e-7;
+#else
+  timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+    return 0;
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+void runBusyPoll(boost::asio::io_context &service,
+                 BusyPollOptions const &options, IoLoopStats &stats)
+{
+  using clock = std::chrono::steady_clock;
+
+  if (!pinCurrentThread(options.core))
+  {
+    BOOST_LOG_TRIVIAL(error)
+        << "Unable to pin io thread to core " << options.core;
+  }
+
+  auto lastActive = clock::now();
+  auto sampleStart = lastActive;
+  auto sampleCpu = currentThreadCpuSeconds();
+
+  while (!service.stopped())
+  {
+    auto ran = service.poll();
+    auto now = clock::now();
+    if (ran == 0 && now - lastActive >= options.spinDuration)
+    {
+      stats.parks.fetch_add(1, std::memory_order_relaxed);
+      ran = service.run_one_for(options.parkTimeout);
+      now = clock::now();
+    }
+    if (ran != 0)
+    {
+      stats.handlers.fetch_add(ran, std::memory_order_relaxed);
+      lastActive = now;
+    }
+
+    auto elapsed = now - sampleStart;
+    if (elapsed >= std::chrono::seconds(1))
+    {
+      auto cpu = currentThreadCpuSeconds();
+      stats.cpuLoad.store(
+          (cpu - sampleCpu) / std::chrono::duration<double>(elapsed).count(),
+          std::memory_order_relaxed);
+      sampleStart = now;
+      sampleCpu = cpu;
+    }
+  }
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "boost/asio/io_context.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+enum class IoMode
+{
+  Blocking = 0,
+  BusyPoll = 1
+};
+
+struct BusyPollOptions
+{
+  // Core the io thread is pinned to, or -1 to leave it unpinned
+  int core = -1;
+  // How long the thread keeps spinning without any ready handlers before it
+  // parks in the kernel until the next event. Once parked it wakes no faster
+  // than a blocking thread, so the default outlasts the primary's one second
+  // heartbeat and the thread only parks when the primary goes quiet.
+  std::chrono::microseconds spinDuration{2000000};
+  // Upper bound on a single park so the CPU load figure stays current
+  std::chrono::milliseconds parkTimeout{100};
+};
+
+struct IoLoopStats
+{
+  std::atomic<std::uint64_t> handlers{0};
+  std::atomic<std::uint64_t> parks{0};
+  // Fraction of one core consumed by the io thread over the last second
+  std::atomic<double> cpuLoad{0};
+};
+
+bool pinCurrentThread(int core);
+double currentThreadCpuSeconds();
+
+// Runs `service` on the calling thread until it is stopped, spinning on
+// poll() while there is traffic and falling back to a blocking wait once
+// nothing has been ready for `options.spinDuration`.
+void runBusyPoll(boost::asio::io_context &service,
+                 BusyPollOptions const &options, IoLoopStats &stats);
@@ -1,4 +1,5 @@
 #include "secondary.hpp"
+#include "secondary_plugin.hpp"
 #include "boost/asio.hpp"
 #include "boost/asio/connect.hpp"
 #include "boost/asio/deadline_timer.hpp"
@@ -15,7 +16,6 @@
 #include "boost/json.hpp"
 #include "boost/json/parse_options.hpp"
 #include "boost/log/trivial.hpp"
-#include "boost/scope_exit.hpp"
 #include "boost/system/detail/errc.hpp"
 #include "boost/system/is_error_code_enum.hpp"
 #include "scconstants.h"
@@ -33,199 +33,6 @@ namespace boost
 void tss_cleanup_implemented() {}
 } // namespace boost
 
-using tcp = boost::asio::ip::tcp;
-using boost::asio::io_service;
-
-struct SecondaryPlugin
-{
-  explicit SecondaryPlugin(std::string const &host, unsigned int port)
-      : m_host(host), m_port(port), m_work(m_service),
-        m_reconnectTimer(m_service), m_socket(m_service),
-        m_thread(std::bind(&SecondaryPlugin::threadFunc, this))
-  {
-    connect();
-  }
-
-  ~SecondaryPlugin()
-  {
-    BOOST_LOG_TRIVIAL(info)
-        << "Stopping secondary client on port " << this->port();
-    m_service.stop();
-
-    try
-    {
-      BOOST_LOG_TRIVIAL(info) << "Joining thread";
-      if (m_thread.joinable())
-        m_thread.join();
-    }
-    catch (...)
-    {
-      BOOST_LOG_TRIVIAL(error) << "Exception when joining thread";
-    }
-  }
-
-  unsigned int port() const { return m_port; }
-  t_OrderQuantity32_64 primaryPositionQty()
-  {
-    std::lock_guard<std::mutex> guard(m_mutex);
-    return m_primaryPosition;
-  }
-
-  bool gotFirstUpdate()
-  {
-    std::lock_guard<std::mutex> guard(m_mutex);
-    return m_gotFirstUpdate;
-  }
-
-  std::string primaryChartbook()
-  {
-    std::lock_guard<std::mutex> guard(m_mutex);
-    return m_primaryChartbook;
-  }
-
-  boost::posix_time::ptime timeOfLastMessage()
-  {
-    std::lock_guard<std::mutex> guard(m_mutex);
-    return m_lastMessageTime;
-  }
-
-private:
-  tcp::resolver::results_type resolve(std::string const &host,
-                                      unsigned int port)
-  {
-    boost::system::error_code ec;
-    std::ostringstream oss;
-    oss << port;
-    tcp::resolver resolver(m_service);
-    return resolver.resolve(host, oss.str(), ec);
-  }
-
-  void connect()
-  {
-    m_reconnectTimer.expires_from_now(boost::asio::chrono::seconds(5));
-    m_reconnectTimer.async_wait(
-        [this](const boost::system::error_code &ec) mutable {
-          auto diff = boost::posix_time::microsec_clock::local_time() -
-                      m_lastMessageTime;
-          if (diff.total_seconds() > 10)
-          {
-            m_socket.close();
-            auto endpoints = resolve(m_host, m_port);
-            BOOST_LOG_TRIVIAL(info)
-                << "Connecting to " << m_host << ":" << m_port;
-            boost::asio::async_connect(
-                m_socket, endpoints,
-                [this](const boost::system::error_code &ec,
-                       const tcp::endpoint &endpoint) {
-                  if (!ec)
-                  {
-                    BOOST_LOG_TRIVIAL(info) << "Connected to " << endpoint;
-                    readNext();
-                  }
-                  else
-                  {
-                    BOOST_LOG_TRIVIAL(info) << "Connection failure " << ec;
-                    m_socket.close();
-                  }
-                });
-          }
-          connect();
-        });
-  }
-
-  void readNext()
-  {
-    boost::asio::async_read_until(
-        m_socket, boost::asio::dynamic_buffer(m_buffer), '\n',
-        [this](const boost::system::error_code &ec, std::size_t bytesRead) {
-          try
-          {
-            m_buffer.pop_back();
-            BOOST_SCOPE_EXIT(&m_buffer) { m_buffer.clear(); }
-            BOOST_SCOPE_EXIT_END;
-
-            BOOST_LOG_TRIVIAL(trace) << "Received: " << m_buffer;
-
-            boost::json::value jv = boost::json::parse(m_buffer);
-            if (auto p = jv.if_object())
-            {
-              std::lock_guard<std::mutex> lock(m_mutex);
-
-              m_lastMessageTime =
-                  boost::posix_time::microsec_clock::local_time();
-              if (auto cb = p->if_contains("cb"))
-              {
-                m_primaryChartbook = cb->as_string();
-              }
-              if (auto position = p->if_contains("position"))
-              {
-                auto pos2 = position->to_number<double>();
-                m_gotFirstUpdate = true;
-                BOOST_LOG_TRIVIAL(info) << "Got position update" << pos2;
-                m_primaryPosition = pos2;
-              }
-            }
-          }
-          catch (std::exception const &e)
-          {
-            BOOST_LOG_TRIVIAL(error) << "Exception: " << e.what();
-          }
-          catch (...)
-          {
-            BOOST_LOG_TRIVIAL(error) << "Unknown exception";
-          }
-          if (ec)
-          {
-            BOOST_LOG_TRIVIAL(error) << "Closing socket due to error: " << ec;
-            m_socket.close();
-          }
-          else
-          {
-            readNext();
-          }
-        });
-  }
-
-  void threadFunc()
-  {
-    BOOST_LOG_TRIVIAL(info) << "Starting thread";
-
-    while (!m_service.stopped())
-    {
-      try
-      {
-        m_service.run();
-      }
-      catch (std::exception const &e)
-      {
-        BOOST_LOG_TRIVIAL(error)
-            << "Exception in io_service::run: " << e.what();
-      }
-      catch (...)
-      {
-        BOOST_LOG_TRIVIAL(error) << "Unknown exception in io_service::run";
-      }
-    }
-    BOOST_LOG_TRIVIAL(info) << "Thread done";
-  }
-
-  std::mutex m_mutex;
-  bool m_gotFirstUpdate = false;
-  boost::posix_time::ptime m_lastMessageTime =
-      boost::posix_time::microsec_clock::local_time();
-  std::string m_primaryChartbook;
-  t_OrderQuantity32_64 m_primaryPosition = 0;
-  std::string m_host;
-  unsigned int m_port;
-  boost::asio::io_service m_service;
-  boost::asio::io_service::work m_work;
-  const tcp::resolver::results_type m_endpoints;
-  tcp::socket m_socket;
-  boost::asio::steady_timer m_reconnectTimer;
-  std::thread m_thread;
-  std::string m_buffer;
-};
-
 const char *hello_secondary() { return "world"; }
 
 enum class OrderType
@@ -253,6 +60,17 @@ SCSFExport scsf_SecondaryInstance(SCStudyInterfaceRef sc)
   SCInputRef Input_MaxPosition = sc.Input[9];
   SCInputRef Input_Multiplier = sc.Input[10];
 
+  SCInputRef Input_IoMode = sc.Input[11];
+  SCInputRef Input_IoCore = sc.Input[12];
+  SCInputRef Input_IoSpinMicros = sc.Input[13];
+
+  SCInputRef Input_TraceEvery = sc.Input[14];
+  SCInputRef Input_TraceFormat = sc.Input[15];
+  SCInputRef Input_TracePath = sc.Input[16];
+  SCInputRef Input_TraceExport = sc.Input[17];
+
+  SCInputRef Input_Priority = sc.Input[18];
+
   try
   {
 
@@ -322,35 +140,114 @@ SCSFExport scsf_SecondaryInstance(SCStudyInterfaceRef sc)
       Input_Multiplier.SetDescription("The position received from the primary "
                                       "chartbook is multiplied by this value");
       Input_Multiplier.SetDoubleLimits(0, 10);
+
+      Input_IoMode.Name = "Network I/O mode";
+      Input_IoMode.SetCustomInputStrings("Blocking;Busy poll");
+      Input_IoMode.SetCustomInputIndex(0);
+      Input_IoMode.SetDescription(
+          "Busy poll spins a dedicated core to cut receive latency");
+
+      Input_IoCore.Name = "Busy poll core (-1 for unpinned)";
+      Input_IoCore.SetInt(-1);
+      Input_IoCore.SetIntLimits(-1, 63);
+
+      Input_IoSpinMicros.Name = "Busy poll spin before parking (us)";
+      Input_IoSpinMicros.SetInt(2000000);
+      Input_IoSpinMicros.SetIntLimits(0, 10000000);
+      Input_IoSpinMicros.SetDescription(
+          "Keep this above the primary's 1 s heartbeat. A shorter spin parks "
+          "the thread between pings and updates arriving then see no benefit "
+          "over blocking mode.");
+
+      Input_TraceEvery.Name = "Trace every Nth position update (0 = off)";
+      Input_TraceEvery.SetInt(0);
+      Input_TraceEvery.SetIntLimits(0, 1000000);
+      Input_TraceEvery.SetDescription(
+          "Use the same value as the primary to trace the same updates");
+
+      Input_TraceFormat.Name = "Trace export format";
+      Input_TraceFormat.SetCustomInputStrings("Chrome trace;JSON");
+      Input_TraceFormat.SetCustomInputIndex(0);
+
+      Input_TracePath.Name = "Trace export file";
+      Input_TracePath.SetString("position_copy_secondary_trace.json");
+
+      Input_TraceExport.Name = "Export trace now";
+      Input_TraceExport.SetYesNo(false);
+
+      Input_Priority.Name = "Follower priority";
+      Input_Priority.SetCustomInputStrings("Critical;Normal;Monitoring");
+      Input_Priority.SetCustomInputIndex(1);
+      Input_Priority.SetDescription(
+          "The primary writes to critical followers first. Monitoring "
+          "followers may skip intermediate updates.");
     }
     else
     {
+      const auto ioMode = static_cast<IoMode>(Input_IoMode.GetIndex());
+      BusyPollOptions pollOptions;
+      pollOptions.core = Input_IoCore.GetInt();
+      pollOptions.spinDuration =
+          std::chrono::microseconds(Input_IoSpinMicros.GetInt());
+
       auto ptr = (SecondaryPlugin *)sc.GetPersistentPointer(1);
-      if (!ptr || ptr->port() != Port.GetInt())
+      if (!ptr || ptr->port() != Port.GetInt() || ptr->ioMode() != ioMode ||
+          (ioMode == IoMode::BusyPoll &&
+           (ptr->pollOptions().core != pollOptions.core ||
+            ptr->pollOptions().spinDuration != pollOptions.spinDuration)))
       {
         delete ptr;
-        ptr = new SecondaryPlugin(Host.GetString(), Port.GetInt());
+        ptr = new SecondaryPlugin(Host.GetString(), Port.GetInt(), ioMode,
+                                  pollOptions);
         sc.SetPersistentPointer(1, ptr);
         sc.AddMessageToLog("Started client", 0);
       }
+      ptr->trace().setSampleEvery(Input_TraceEvery.GetInt());
+      ptr->setPriority(
+          static_cast<FollowerPriority>(Input_Priority.GetIndex()));
+      if (Input_TraceExport.GetYesNo())
+      {
+        Input_TraceExport.SetYesNo(false);
+        auto format = static_cast<TraceFormat>(Input_TraceFormat.GetIndex());
+        if (ptr->trace().writeFile(Input_TracePath.GetString(), format,
+                                   "secondary"))
+          sc.AddMessageToLog("Exported trace", 0);
+        else
+          sc.AddMessageToLog("Unable to export trace", 1);
+      }
+      const auto target = ptr->primaryTarget();
+      const auto seq = target.seq;
+      ptr->tracePickup(seq);
       s_SCPositionData position;
       const auto multiplier = std::max(0.0, Input_Multiplier.GetDouble());
+      const auto maxPosition = multiplier * Input_MaxPosition.GetDouble();
+      // Orders beyond the maximum position are rejected, so aim for the
+      // capped position and count reaching it as converged
+      const auto wantedPosition =
+          std::max(-maxPosition,
+                   std::min(maxPosition, multiplier * target.position));
       // We want to wait until we have at least one update because otherwise the
       // initial "primary position" will be zero and that will cause us to close
       // any open positions which would not be desired.
-      if (ptr->gotFirstUpdate() && sc.GetTradePosition(position) > 0 &&
+      const bool havePosition = sc.GetTradePosition(position) > 0;
+      if (target.gotFirstUpdate && havePosition)
+      {
+        ptr->reportState(position.PositionQuantity,
+                         position.WorkingOrdersExist, target,
+                         !position.WorkingOrdersExist &&
+                             wantedPosition == position.PositionQuantity);
+      }
+      if (target.gotFirstUpdate && havePosition &&
           !position.WorkingOrdersExist)
       {
-        auto delta =
-            multiplier * ptr->primaryPositionQty() - position.PositionQuantity;
+        auto delta = wantedPosition - position.PositionQuantity;
         if (delta != 0)
         {
           sc.SendOrdersToTradeService = 1;
           sc.AllowMultipleEntriesInSameDirection = 1;
           sc.AllowEntryWithWorkingOrders = 0;
           sc.AllowOnlyOneTradePerBar = 0;
-          sc.MaximumPositionAllowed =
-              multiplier * Input_MaxPosition.GetDouble();
+          sc.MaximumPositionAllowed = maxPosition;
 
           s_SCNewOrder newOrder;
           newOrder.OrderQuantity = delta;
@@ -388,6 +285,7 @@ SCSFExport scsf_SecondaryInstance(SCStudyInterfaceRef sc)
           {
             ret = sc.SellEntry(newOrder);
           }
+          ptr->trace().record(seq, TraceStage::OrderReturn);
           if (ret < 0)
           {
             BOOST_LOG_TRIVIAL(error) << "Order submission ignored: " << ret;
@@ -410,6 +308,14 @@ SCSFExport scsf_SecondaryInstance(SCStudyInterfaceRef sc)
           "Connected to port %d book %s (multiplier: %d, ping: %d ms)", port,
           primaryChartbook.c_str(), (int)multiplier,
           timeSinceLastMessage.total_milliseconds());
+      if (ptr->ioMode() == IoMode::BusyPoll)
+      {
+        SCString IoInfo;
+        IoInfo.Format(" busy poll core %d cpu: %d%%",
+                      ptr->pollOptions().core,
+                      (int)(100 * ptr->ioCpuLoad()));
+        ConnectionInfo += IoInfo;
+      }
 
       if (timeSinceLastMessage >= boost::posix_time::seconds(5) &&
           int(timeSinceLastMessage.total_seconds()) % 5 == 0)
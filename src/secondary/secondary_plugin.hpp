@@ -0,0 +1,490 @@
+#pragma once
+
+#include "io_loop.hpp"
+#include "priority.hpp"
+#include "trace.hpp"
+#include "boost/asio.hpp"
+#include "boost/asio/connect.hpp"
+#include "boost/asio/io_service.hpp"
+#include "boost/asio/post.hpp"
+#include "boost/asio/read_until.hpp"
+#include "boost/asio/steady_timer.hpp"
+#include "boost/asio/write.hpp"
+#include "boost/date_time/posix_time/posix_time_config.hpp"
+#include "boost/date_time/posix_time/posix_time_types.hpp"
+#include "boost/json.hpp"
+#include "boost/log/trivial.hpp"
+#include "sierrachart.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+
+struct ReconnectOptions
+{
+  // How often the primary pings its followers
+  std::chrono::milliseconds heartbeatInterval{1000};
+  // Pings that may go missing before the connection is considered dead
+  unsigned int missedHeartbeats = 3;
+  std::chrono::milliseconds initialBackoff{100};
+  std::chrono::milliseconds maxBackoff{5000};
+};
+
+// Delay before each reconnect attempt. The first retry is immediate, after
+// that delays double up to the cap with random jitter so a fleet of
+// followers does not reconnect in lockstep.
+class ReconnectBackoff
+{
+public:
+  explicit ReconnectBackoff(ReconnectOptions const &options)
+      : m_initial(options.initialBackoff), m_max(options.maxBackoff),
+        m_rng(std::random_device{}())
+  {
+  }
+
+  std::chrono::milliseconds next()
+  {
+    if (m_attempt++ == 0)
+      return std::chrono::milliseconds(0);
+    auto ceiling = m_initial;
+    for (unsigned int i = 1; i < m_attempt - 1 && ceiling < m_max; ++i)
+      ceiling *= 2;
+    ceiling = std::min(ceiling, m_max);
+    std::uniform_int_distribution<long long> jitter(ceiling.count() / 2,
+                                                    ceiling.count());
+    return std::chrono::milliseconds(jitter(m_rng));
+  }
+
+  void reset() { m_attempt = 0; }
+
+private:
+  std::chrono::milliseconds m_initial;
+  std::chrono::milliseconds m_max;
+  std::minstd_rand m_rng;
+  unsigned int m_attempt = 0;
+};
+
+using tcp = boost::asio::ip::tcp;
+
+// The latest update from the primary, read under a single lock so the
+// position always belongs to the sequence number next to it
+struct PrimaryTarget
+{
+  bool gotFirstUpdate = false;
+  t_OrderQuantity32_64 position = 0;
+  std::uint64_t seq = 0;
+  std::int64_t session = 0;
+};
+
+struct SecondaryPlugin
+{
+  explicit SecondaryPlugin(std::string const &host, unsigned int port,
+                           IoMode ioMode = IoMode::Blocking,
+                           BusyPollOptions pollOptions = {},
+                           ReconnectOptions reconnectOptions = {})
+      : m_host(host), m_port(port), m_ioMode(ioMode),
+        m_pollOptions(pollOptions), m_reconnectOptions(reconnectOptions),
+        m_backoff(reconnectOptions), m_work(m_service), m_resolver(m_service),
+        m_socket(m_service), m_reconnectTimer(m_service),
+        m_livenessTimer(m_service),
+        m_thread(std::bind(&SecondaryPlugin::threadFunc, this))
+  {
+    boost::asio::post(m_service, [this]() { connect(); });
+  }
+
+  ~SecondaryPlugin()
+  {
+    BOOST_LOG_TRIVIAL(info)
+        << "Stopping secondary client on port " << this->port();
+    m_service.stop();
+
+    try
+    {
+      BOOST_LOG_TRIVIAL(info) << "Joining thread";
+      if (m_thread.joinable())
+        m_thread.join();
+    }
+    catch (...)
+    {
+      BOOST_LOG_TRIVIAL(error) << "Exception when joining thread";
+    }
+  }
+
+  unsigned int port() const { return m_port; }
+  IoMode ioMode() const { return m_ioMode; }
+  BusyPollOptions const &pollOptions() const { return m_pollOptions; }
+  double ioCpuLoad() const
+  {
+    return m_ioStats.cpuLoad.load(std::memory_order_relaxed);
+  }
+
+  std::string primaryChartbook()
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_primaryChartbook;
+  }
+
+  boost::posix_time::ptime timeOfLastMessage()
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_lastMessageTime;
+  }
+
+  PrimaryTarget primaryTarget()
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    PrimaryTarget target;
+    target.gotFirstUpdate = m_gotFirstUpdate;
+    target.position = m_primaryPosition;
+    target.seq = m_primarySeq;
+    target.session = m_primarySession;
+    return target;
+  }
+
+  // Number of connections established so far
+  unsigned int connectCount() const { return m_connectCount; }
+
+  TraceBuffer &trace() { return m_trace; }
+
+  // Only called from the study thread. Tells the primary where this follower
+  // is whenever that changes, including the last update it fully reached.
+  void reportState(t_OrderQuantity32_64 position, bool workingOrders,
+                   PrimaryTarget const &target, bool converged)
+  {
+    // A new primary session restarts its sequence numbers
+    if (target.session != m_reportedSession)
+    {
+      m_reportedSession = target.session;
+      m_convergedSeq = 0;
+    }
+    if (converged)
+      m_convergedSeq = target.seq;
+    boost::json::object msg = {{"position", position},
+                               {"working", workingOrders},
+                               {"converged", m_convergedSeq},
+                               {"session", m_reportedSession}};
+    auto report = boost::json::serialize(msg) + "\n";
+    if (report == m_reported)
+      return;
+    m_reported = report;
+    boost::asio::post(m_service, [this, report]() {
+      m_lastReport = report;
+      m_reportDirty = true;
+      writeReport();
+    });
+  }
+
+  // Only called from the study thread. The priority is announced on every
+  // connection and again whenever it changes.
+  void setPriority(FollowerPriority priority)
+  {
+    if (priority == m_priority)
+      return;
+    m_priority = priority;
+    boost::json::object msg = {{"priority", static_cast<int>(priority)}};
+    auto hello = boost::json::serialize(msg) + "\n";
+    boost::asio::post(m_service, [this, hello]() {
+      m_hello = hello;
+      m_helloPending = true;
+      writeReport();
+    });
+  }
+
+  // Only called from the study thread
+  void tracePickup(std::uint64_t seq)
+  {
+    if (seq != m_pickedSeq)
+    {
+      m_pickedSeq = seq;
+      m_trace.record(seq, TraceStage::StudyPickup);
+    }
+  }
+
+private:
+  // Starts a connection attempt. The host is only looked up when there is no
+  // cached result from an earlier attempt.
+  void connect()
+  {
+    m_connected = false;
+    boost::system::error_code ec;
+    m_socket.close(ec);
+    m_buffer.clear();
+    if (!m_endpoints.empty())
+    {
+      connectTo(m_endpoints);
+      return;
+    }
+    m_resolver.async_resolve(
+        m_host, std::to_string(m_port),
+        [this](const boost::system::error_code &ec,
+               tcp::resolver::results_type results) {
+          if (ec)
+          {
+            BOOST_LOG_TRIVIAL(error)
+                << "Unable to resolve " << m_host << ": " << ec;
+            scheduleReconnect();
+            return;
+          }
+          m_endpoints = results;
+          connectTo(m_endpoints);
+        });
+  }
+
+  void connectTo(tcp::resolver::results_type const &endpoints)
+  {
+    BOOST_LOG_TRIVIAL(info) << "Connecting to " << m_host << ":" << m_port;
+    boost::asio::async_connect(
+        m_socket, endpoints,
+        [this](const boost::system::error_code &ec,
+               const tcp::endpoint &endpoint) {
+          if (ec)
+          {
+            BOOST_LOG_TRIVIAL(info) << "Connection failure " << ec;
+            // The cached address may be stale, look it up again next time
+            m_endpoints = {};
+            scheduleReconnect();
+            return;
+          }
+          BOOST_LOG_TRIVIAL(info) << "Connected to " << endpoint;
+          {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_lastMessageTime = boost::posix_time::microsec_clock::local_time();
+          }
+          m_lastHeard = std::chrono::steady_clock::now();
+          ++m_connectCount;
+          m_connected = true;
+          readNext();
+          m_helloPending = !m_hello.empty();
+          m_reportDirty = !m_lastReport.empty();
+          writeReport();
+          checkLiveness();
+        });
+  }
+
+  void scheduleReconnect()
+  {
+    auto delay = m_backoff.next();
+    BOOST_LOG_TRIVIAL(info) << "Reconnecting in " << delay.count() << " ms";
+    m_reconnectTimer.expires_after(delay);
+    m_reconnectTimer.async_wait([this](const boost::system::error_code &ec) {
+      if (!ec)
+        connect();
+    });
+  }
+
+  void disconnected()
+  {
+    m_connected = false;
+    m_livenessTimer.cancel();
+    boost::system::error_code ec;
+    m_socket.close(ec);
+    scheduleReconnect();
+  }
+
+  // The primary pings every heartbeat interval, so a connection that stays
+  // silent for several of them is treated as dead even if TCP has not
+  // noticed yet.
+  void checkLiveness()
+  {
+    m_livenessTimer.expires_after(m_reconnectOptions.heartbeatInterval);
+    m_livenessTimer.async_wait([this](const boost::system::error_code &ec) {
+      if (ec || !m_connected)
+        return;
+      auto silence = std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - m_lastHeard);
+      auto limit = m_reconnectOptions.heartbeatInterval *
+                   m_reconnectOptions.missedHeartbeats;
+      if (silence > limit)
+      {
+        BOOST_LOG_TRIVIAL(error)
+            << "No message from primary for " << silence.count() << " ms";
+        disconnected();
+      }
+      else
+      {
+        checkLiveness();
+      }
+    });
+  }
+
+  // Only the latest report matters, so anything queued while a write is in
+  // flight is overwritten rather than sent in turn. The socket is open while
+  // async_connect is still in progress, hence the separate connected flag.
+  void writeReport()
+  {
+    if (m_writing || !(m_reportDirty || m_helloPending) || !m_connected)
+      return;
+    m_writing = true;
+    m_outBuffer.clear();
+    if (m_helloPending)
+      m_outBuffer = m_hello;
+    if (m_reportDirty)
+      m_outBuffer += m_lastReport;
+    m_helloPending = false;
+    m_reportDirty = false;
+    boost::asio::async_write(
+        m_socket, boost::asio::buffer(m_outBuffer),
+        [this](const boost::system::error_code &ec, std::size_t) {
+          m_writing = false;
+          if (ec)
+          {
+            BOOST_LOG_TRIVIAL(error) << "Unable to report state: " << ec;
+          }
+          // A reconnect may have queued the hello and report while this
+          // write was still outstanding
+          writeReport();
+        });
+  }
+
+  void readNext()
+  {
+    boost::asio::async_read_until(
+        m_socket, boost::asio::dynamic_buffer(m_buffer), '\n',
+        [this](const boost::system::error_code &ec, std::size_t bytesRead) {
+          const auto received = TraceBuffer::now();
+          if (ec)
+          {
+            // Aborted reads come from us closing the socket, in which case a
+            // reconnect is already scheduled
+            if (ec != boost::asio::error::operation_aborted)
+            {
+              BOOST_LOG_TRIVIAL(error)
+                  << "Closing socket due to error: " << ec;
+              disconnected();
+            }
+            return;
+          }
+          m_lastHeard = std::chrono::steady_clock::now();
+          try
+          {
+            auto line = m_buffer.substr(0, bytesRead - 1);
+            m_buffer.erase(0, bytesRead);
+
+            BOOST_LOG_TRIVIAL(trace) << "Received: " << line;
+
+            boost::json::value jv = boost::json::parse(line);
+            if (auto p = jv.if_object())
+            {
+              std::lock_guard<std::mutex> lock(m_mutex);
+
+              m_lastMessageTime =
+                  boost::posix_time::microsec_clock::local_time();
+              if (auto cb = p->if_contains("cb"))
+              {
+                m_primaryChartbook = cb->as_string();
+              }
+              if (auto position = p->if_contains("position"))
+              {
+                auto pos2 = position->to_number<double>();
+                m_gotFirstUpdate = true;
+                BOOST_LOG_TRIVIAL(info) << "Got position update" << pos2;
+                m_primaryPosition = pos2;
+                if (auto session = p->if_contains("session"))
+                {
+                  m_primarySession = session->to_number<std::int64_t>();
+                }
+                if (auto seq = p->if_contains("seq"))
+                {
+                  m_primarySeq = seq->to_number<std::uint64_t>();
+                  // The position replayed on every connect was traced when
+                  // it was first published
+                  if (!p->if_contains("replay"))
+                  {
+                    m_trace.record(m_primarySeq, TraceStage::SecondaryReceive,
+                                   received);
+                    m_trace.record(m_primarySeq, TraceStage::Parse);
+                  }
+                }
+              }
+              // The primary is talking to us, so the next failure gets an
+              // immediate retry again
+              m_backoff.reset();
+            }
+          }
+          catch (std::exception const &e)
+          {
+            BOOST_LOG_TRIVIAL(error) << "Exception: " << e.what();
+          }
+          catch (...)
+          {
+            BOOST_LOG_TRIVIAL(error) << "Unknown exception";
+          }
+          readNext();
+        });
+  }
+
+  void threadFunc()
+  {
+    BOOST_LOG_TRIVIAL(info) << "Starting thread";
+
+    while (!m_service.stopped())
+    {
+      try
+      {
+        if (m_ioMode == IoMode::BusyPoll)
+        {
+          runBusyPoll(m_service, m_pollOptions, m_ioStats);
+        }
+        else
+        {
+          m_service.run();
+        }
+      }
+      catch (std::exception const &e)
+      {
+        BOOST_LOG_TRIVIAL(error)
+            << "Exception in io_service::run: " << e.what();
+      }
+      catch (...)
+      {
+        BOOST_LOG_TRIVIAL(error) << "Unknown exception in io_service::run";
+      }
+    }
+    BOOST_LOG_TRIVIAL(info) << "Thread done";
+  }
+
+  std::mutex m_mutex;
+  bool m_gotFirstUpdate = false;
+  boost::posix_time::ptime m_lastMessageTime =
+      boost::posix_time::microsec_clock::local_time();
+  std::string m_primaryChartbook;
+  t_OrderQuantity32_64 m_primaryPosition = 0;
+  std::uint64_t m_primarySeq = 0;
+  std::int64_t m_primarySession = 0;
+  std::uint64_t m_pickedSeq = 0;
+  std::uint64_t m_convergedSeq = 0;
+  std::int64_t m_reportedSession = 0;
+  std::string m_reported;
+  FollowerPriority m_priority = FollowerPriority::Normal;
+  TraceBuffer m_trace;
+  std::string m_host;
+  unsigned int m_port;
+  IoMode m_ioMode;
+  BusyPollOptions m_pollOptions;
+  IoLoopStats m_ioStats;
+  ReconnectOptions m_reconnectOptions;
+  ReconnectBackoff m_backoff;
+  std::atomic<unsigned int> m_connectCount{0};
+  boost::asio::io_service m_service;
+  boost::asio::io_service::work m_work;
+  tcp::resolver m_resolver;
+  tcp::resolver::results_type m_endpoints;
+  tcp::socket m_socket;
+  boost::asio::steady_timer m_reconnectTimer;
+  boost::asio::steady_timer m_livenessTimer;
+  std::thread m_thread;
+  std::string m_buffer;
+  std::string m_hello;
+  std::string m_lastReport;
+  std::string m_outBuffer;
+  bool m_helloPending = false;
+  bool m_reportDirty = false;
+  bool m_writing = false;
+  bool m_connected = false;
+  // Liveness is timed on the steady clock, m_lastMessageTime is only for
+  // display and follows the wall clock through DST and NTP changes
+  std::chrono::steady_clock::time_point m_lastHeard;
+};
@@ -0,0 +1,77 @@
+#include "trace.hpp"
+#include "gtest/gtest.h"
+#include <sstream>
+
+TEST(TraceBufferTest, DisabledByDefault)
+{
+  TraceBuffer trace(4);
+  trace.record(1, TraceStage::PrimaryDetect);
+  EXPECT_TRUE(trace.snapshot().empty());
+}
+
+TEST(TraceBufferTest, SamplesEveryNth)
+{
+  TraceBuffer trace(16);
+  trace.setSampleEvery(2);
+  for (std::uint64_t seq = 1; seq <= 4; ++seq)
+    trace.record(seq, TraceStage::Enqueue);
+
+  auto records = trace.snapshot();
+  ASSERT_EQ(records.size(), 2u);
+  EXPECT_EQ(records[0].seq, 2u);
+  EXPECT_EQ(records[1].seq, 4u);
+}
+
+TEST(TraceBufferTest, KeepsNewestWhenFull)
+{
+  TraceBuffer trace(3);
+  trace.setSampleEvery(1);
+  for (std::uint64_t seq = 1; seq <= 5; ++seq)
+    trace.record(seq, TraceStage::Parse, seq * 10);
+
+  auto records = trace.snapshot();
+  ASSERT_EQ(records.size(), 3u);
+  EXPECT_EQ(records[0].seq, 3u);
+  EXPECT_EQ(records[2].seq, 5u);
+  EXPECT_EQ(records[2].timestamp, 50);
+}
+
+TEST(TraceBufferTest, RecordsFollower)
+{
+  TraceBuffer trace(4);
+  trace.setSampleEvery(1);
+  trace.record(3, TraceStage::WriteComplete, 10, 1);
+  trace.record(3, TraceStage::WriteComplete, 20, 2);
+
+  auto records = trace.snapshot();
+  ASSERT_EQ(records.size(), 2u);
+  EXPECT_EQ(records[0].follower, 1u);
+  EXPECT_EQ(records[1].follower, 2u);
+
+  std::ostringstream chrome;
+  trace.write(chrome, TraceFormat::Chrome, "primary");
+  EXPECT_NE(chrome.str().find("\"ts\":20,\"args\":{\"follower\":2}"),
+            std::string::npos);
+
+  std::ostringstream json;
+  trace.write(json, TraceFormat::Json, "primary");
+  EXPECT_NE(json.str().find("\"ts\":10,\"follower\":1"), std::string::npos);
+}
+
+TEST(TraceBufferTest, WritesChromeAndJson)
+{
+  TraceBuffer trace(4);
+  trace.setSampleEvery(1);
+  trace.record(7, TraceStage::OrderReturn, 123);
+
+  std::ostringstream chrome;
+  trace.write(chrome, TraceFormat::Chrome, "secondary");
+  EXPECT_NE(chrome.str().find("\"traceEvents\""), std::string::npos);
+  EXPECT_NE(chrome.str().find("\"name\":\"order_return\""), std::string::npos);
+  EXPECT_NE(chrome.str().find("\"tid\":7,\"ts\":123"), std::string::npos);
+
+  std::ostringstream json;
+  trace.write(json, TraceFormat::Json, "secondary");
+  EXPECT_NE(json.str().find("\"seq\":7,\"stage\":\"order_return\",\"ts\":123"),
+            std::string::npos);
+}
@@ -1,4 +1,120 @@
 #include "primary.hpp"
+#include "primary_plugin.hpp"
 #include "gtest/gtest.h"
+#include <chrono>
+#include <thread>
 
 TEST(HelloPrimaryTest, BasicTest) { EXPECT_STREQ(hello_primary(), "world"); }
+
+namespace
+{
+OutgoingMessage message(std::string const &json, bool isPosition)
+{
+  return {std::make_shared<const std::string>(json), 0, isPosition,
+          boost::posix_time::microsec_clock::universal_time()};
+}
+} // namespace
+
+TEST(ConnectionQueueTest, MonitoringKeepsOnlyLatestOfEachKind)
+{
+  boost::asio::io_context service;
+  Connection conn(tcp::socket(service), 1);
+  conn.setPriority(FollowerPriority::Monitoring);
+
+  EXPECT_TRUE(conn.push(message("position 1", true)));
+  EXPECT_TRUE(conn.push(message("ping 1", false)));
+  EXPECT_TRUE(conn.push(message("position 2", true)));
+  EXPECT_TRUE(conn.push(message("ping 2", false)));
+
+  ASSERT_EQ(conn.queued(), 2u);
+  EXPECT_EQ(*conn.pop().json, "position 2");
+  EXPECT_EQ(*conn.pop().json, "ping 2");
+}
+
+TEST(ConnectionQueueTest, OtherTiersKeepEverythingUntilFull)
+{
+  boost::asio::io_context service;
+  Connection conn(tcp::socket(service), 1);
+  conn.setPriority(FollowerPriority::Critical);
+
+  for (std::size_t i = 0; i < Connection::maxQueued; ++i)
+    ASSERT_TRUE(conn.push(message("position", true)));
+  EXPECT_FALSE(conn.push(message("position", true)));
+  EXPECT_EQ(conn.queued(), Connection::maxQueued);
+}
+
+TEST(PrimaryPluginTest, CriticalFollowerServedFirstAfterHello)
+{
+  using namespace std::chrono;
+
+  PrimaryPlugin plugin("test", 0);
+  tcp::endpoint endpoint(boost::asio::ip::address_v4::loopback(),
+                         plugin.localPort());
+
+  boost::asio::io_context service;
+  tcp::socket normal(service);
+  normal.connect(endpoint);
+  tcp::socket critical(service);
+  critical.connect(endpoint);
+
+  auto waitFor = [](auto condition) {
+    auto deadline = steady_clock::now() + seconds(5);
+    while (!condition() && steady_clock::now() < deadline)
+      std::this_thread::sleep_for(milliseconds(1));
+    return condition();
+  };
+  ASSERT_TRUE(waitFor([&]() { return plugin.numClients() == 2; }));
+  EXPECT_EQ(plugin.priorities(),
+            (std::vector<FollowerPriority>{FollowerPriority::Normal,
+                                           FollowerPriority::Normal}));
+
+  boost::asio::write(critical, boost::asio::buffer(std::string(
+                                   "{\"priority\":0}\n")));
+  ASSERT_TRUE(waitFor([&]() {
+    return plugin.priorities() ==
+           std::vector<FollowerPriority>{FollowerPriority::Critical,
+                                         FollowerPriority::Normal};
+  }));
+
+  // The position replayed to each follower on connect is not a delivery
+  auto tierCount = [&](FollowerPriority priority) {
+    return plugin.tierLatencies()[static_cast<int>(priority)].count;
+  };
+  EXPECT_EQ(tierCount(FollowerPriority::Critical), 0u);
+
+  plugin.trace().setSampleEvery(1);
+  plugin.processPosition(3);
+  EXPECT_TRUE(waitFor([&]() {
+    return tierCount(FollowerPriority::Critical) == 1 &&
+           tierCount(FollowerPriority::Normal) == 1;
+  }));
+
+  // Followers were numbered in the order they connected
+  const std::uint16_t criticalId = 2;
+  std::vector<std::uint16_t> writes;
+  for (auto const &r : plugin.trace().snapshot())
+  {
+    if (r.stage == TraceStage::WriteComplete && r.seq == 1)
+      writes.push_back(r.follower);
+  }
+  ASSERT_EQ(writes.size(), 2u);
+  EXPECT_EQ(writes[0], criticalId);
+
+  // Skip the replay and any pings to find the published update
+  std::string buffer;
+  bool received = false;
+  while (!received)
+  {
+    auto n = boost::asio::read_until(
+        critical, boost::asio::dynamic_buffer(buffer), '\n');
+    auto jv = boost::json::parse(buffer.substr(0, n - 1));
+    buffer.erase(0, n);
+    auto p = jv.if_object();
+    ASSERT_NE(p, nullptr);
+    if (p->if_contains("replay") || !p->if_contains("seq"))
+      continue;
+    EXPECT_EQ(p->if_contains("seq")->to_number<std::uint64_t>(), 1u);
+    EXPECT_EQ(p->if_contains("position")->to_number<double>(), 3);
+    received = true;
+  }
+}
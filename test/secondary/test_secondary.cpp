@@ -1,7 +1,263 @@
 #include "secondary.hpp"
+#include "secondary_plugin.hpp"
+#include "boost/asio.hpp"
 #include "gtest/gtest.h"
+#include <algorithm>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+using tcp = boost::asio::ip::tcp;
 
 TEST(HelloSecondaryTest, BasicTest)
 {
   EXPECT_STREQ(hello_secondary(), "world");
 }
+
+namespace
+{
+using Clock = std::chrono::steady_clock;
+} // namespace
+
+TEST(SecondaryReconnectTest, BackoffStartsImmediatelyAndIsCapped)
+{
+  ReconnectOptions options;
+  options.initialBackoff = std::chrono::milliseconds(100);
+  options.maxBackoff = std::chrono::milliseconds(400);
+  ReconnectBackoff backoff(options);
+
+  EXPECT_EQ(backoff.next().count(), 0);
+  auto first = backoff.next().count();
+  EXPECT_GE(first, 50);
+  EXPECT_LE(first, 100);
+  auto second = backoff.next().count();
+  EXPECT_GE(second, 100);
+  EXPECT_LE(second, 200);
+  for (int i = 0; i < 10; ++i)
+  {
+    auto delay = backoff.next().count();
+    EXPECT_GE(delay, 200);
+    EXPECT_LE(delay, 400);
+  }
+
+  backoff.reset();
+  EXPECT_EQ(backoff.next().count(), 0);
+}
+
+namespace
+{
+bool acceptWithin(boost::asio::io_context &service, tcp::acceptor &acceptor,
+                  tcp::socket &socket, std::chrono::milliseconds timeout)
+{
+  bool accepted = false;
+  acceptor.async_accept(
+      socket, [&](boost::system::error_code const &ec) { accepted = !ec; });
+  service.restart();
+  service.run_for(timeout);
+  if (!accepted)
+  {
+    acceptor.cancel();
+    service.restart();
+    service.run();
+  }
+  return accepted;
+}
+} // namespace
+
+TEST(SecondaryReconnectTest, RecoveryTime)
+{
+  using std::chrono::milliseconds;
+
+  boost::asio::io_context service;
+  tcp::acceptor acceptor(
+      service, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+
+  ReconnectOptions options;
+  options.heartbeatInterval = milliseconds(50);
+  SecondaryPlugin plugin("127.0.0.1", acceptor.local_endpoint().port(),
+                         IoMode::Blocking, {}, options);
+
+  auto start = Clock::now();
+  tcp::socket socket(service);
+  ASSERT_TRUE(acceptWithin(service, acceptor, socket, milliseconds(2000)));
+  auto startup = Clock::now() - start;
+
+  // The primary drops the connection
+  start = Clock::now();
+  socket.close();
+  ASSERT_TRUE(acceptWithin(service, acceptor, socket, milliseconds(2000)));
+  auto afterError = Clock::now() - start;
+
+  // The primary goes quiet but leaves the connection open
+  start = Clock::now();
+  tcp::socket next(service);
+  ASSERT_TRUE(acceptWithin(service, acceptor, next, milliseconds(2000)));
+  auto afterSilence = Clock::now() - start;
+
+  EXPECT_LT(startup, milliseconds(1000));
+  EXPECT_LT(afterError, milliseconds(1000));
+  EXPECT_LT(afterSilence, milliseconds(1000));
+  // The client side of the last connection may still be completing
+  auto deadline = Clock::now() + milliseconds(1000);
+  while (plugin.connectCount() < 3 && Clock::now() < deadline)
+    std::this_thread::sleep_for(milliseconds(1));
+  EXPECT_EQ(plugin.connectCount(), 3u);
+
+  auto ms = [](Clock::duration d) {
+    return std::chrono::duration_cast<milliseconds>(d).count();
+  };
+  std::cout << "startup: " << ms(startup) << "ms recovery after error: "
+            << ms(afterError) << "ms recovery after silence: "
+            << ms(afterSilence) << "ms" << std::endl;
+}
+
+TEST(SecondaryTraceTest, ReplayedPositionIsNotTraced)
+{
+  using std::chrono::milliseconds;
+
+  boost::asio::io_context service;
+  tcp::acceptor acceptor(
+      service, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+  SecondaryPlugin plugin("127.0.0.1", acceptor.local_endpoint().port());
+  plugin.trace().setSampleEvery(1);
+
+  tcp::socket socket(service);
+  ASSERT_TRUE(acceptWithin(service, acceptor, socket, milliseconds(2000)));
+  std::string updates = "{\"position\":1,\"seq\":1,\"replay\":true}\n"
+                        "{\"position\":2,\"seq\":2}\n";
+  boost::asio::write(socket, boost::asio::buffer(updates));
+
+  auto deadline = Clock::now() + milliseconds(2000);
+  while (plugin.primaryTarget().seq != 2 && Clock::now() < deadline)
+    std::this_thread::sleep_for(milliseconds(1));
+  ASSERT_EQ(plugin.primaryTarget().seq, 2u);
+
+  auto records = plugin.trace().snapshot();
+  ASSERT_EQ(records.size(), 2u);
+  EXPECT_EQ(records[0].seq, 2u);
+  EXPECT_EQ(records[0].stage, TraceStage::SecondaryReceive);
+  EXPECT_EQ(records[1].seq, 2u);
+  EXPECT_EQ(records[1].stage, TraceStage::Parse);
+}
+
+namespace
+{
+struct LatencyResult
+{
+  std::size_t samples;
+  std::chrono::microseconds p99;
+  double cpuLoad;
+};
+
+// Plays the primary for a SecondaryPlugin running its io thread in `mode`
+// and measures, from the plugin's own receive trace, how long each of `count`
+// position updates sent `interval` apart takes from the write here to the
+// plugin's read completing.
+LatencyResult measureReceiveLatency(IoMode mode, BusyPollOptions options,
+                                    std::size_t count,
+                                    std::chrono::microseconds interval)
+{
+  using std::chrono::milliseconds;
+
+  boost::asio::io_context service;
+  tcp::acceptor acceptor(
+      service, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+  SecondaryPlugin plugin("127.0.0.1", acceptor.local_endpoint().port(), mode,
+                         options);
+  plugin.trace().setSampleEvery(1);
+
+  LatencyResult result{0, {}, 0};
+  tcp::socket socket(service);
+  if (!acceptWithin(service, acceptor, socket, milliseconds(2000)))
+    return result;
+  socket.set_option(tcp::no_delay(true));
+
+  std::vector<std::int64_t> sent(count + 1);
+  for (std::size_t seq = 1; seq <= count; ++seq)
+  {
+    auto line = "{\"position\":" + std::to_string(seq % 2) + ",\"seq\":" +
+                std::to_string(seq) + "}\n";
+    sent[seq] = TraceBuffer::now();
+    boost::asio::write(socket, boost::asio::buffer(line));
+    std::this_thread::sleep_for(interval);
+  }
+
+  std::vector<std::chrono::microseconds> latencies;
+  auto deadline = Clock::now() + milliseconds(5000);
+  do
+  {
+    latencies.clear();
+    for (auto const &r : plugin.trace().snapshot())
+    {
+      if (r.stage == TraceStage::SecondaryReceive && r.seq <= count)
+        latencies.emplace_back(r.timestamp - sent[r.seq]);
+    }
+    std::this_thread::sleep_for(milliseconds(1));
+  } while (latencies.size() < count && Clock::now() < deadline);
+
+  result.samples = latencies.size();
+  result.cpuLoad = plugin.ioCpuLoad();
+  if (!latencies.empty())
+  {
+    auto p99 = latencies.begin() + (latencies.size() * 99) / 100;
+    std::nth_element(latencies.begin(), p99, latencies.end());
+    result.p99 = *p99;
+  }
+  return result;
+}
+} // namespace
+
+// Takes a while and keeps a core spinning, so it only runs when asked for:
+//   test_secondary --gtest_also_run_disabled_tests
+//                  --gtest_filter=IoLoopBenchmark.*
+TEST(IoLoopBenchmark, DISABLED_ReceiveLatencyP99)
+{
+  using std::chrono::microseconds;
+
+  auto report = [](const char *name, LatencyResult const &result) {
+    std::cout << name << " p99 receive latency: " << result.p99.count()
+              << "us over " << result.samples << " updates";
+    // Only the busy poll loop samples its CPU load
+    if (result.cpuLoad > 0)
+      std::cout << " (cpu: " << int(100 * result.cpuLoad) << "%)";
+    std::cout << std::endl;
+  };
+
+  // Back to back updates keep the busy poll loop spinning throughout
+  const std::size_t burst = 4000;
+  const microseconds burstInterval(500);
+  auto blocking =
+      measureReceiveLatency(IoMode::Blocking, {}, burst, burstInterval);
+  auto busyPoll =
+      measureReceiveLatency(IoMode::BusyPoll, {}, burst, burstInterval);
+  report("burst blocking", blocking);
+  report("burst busy poll", busyPoll);
+  EXPECT_EQ(blocking.samples, burst);
+  EXPECT_EQ(busyPoll.samples, burst);
+
+  // Updates further apart than a short spin, as the primary's pings and
+  // position changes usually are. With the default spin the loop is still
+  // spinning when each one arrives, with the short one it has parked.
+  const std::size_t sparse = 200;
+  const microseconds sparseInterval(20000);
+  BusyPollOptions shortSpin;
+  shortSpin.spinDuration = sparseInterval / 4;
+  auto sparseBlocking =
+      measureReceiveLatency(IoMode::Blocking, {}, sparse, sparseInterval);
+  auto sparseBusyPoll =
+      measureReceiveLatency(IoMode::BusyPoll, {}, sparse, sparseInterval);
+  auto sparseParked = measureReceiveLatency(IoMode::BusyPoll, shortSpin,
+                                            sparse, sparseInterval);
+  report("sparse blocking", sparseBlocking);
+  report("sparse busy poll", sparseBusyPoll);
+  report("sparse busy poll, short spin", sparseParked);
+  EXPECT_EQ(sparseBlocking.samples, sparse);
+  EXPECT_EQ(sparseBusyPoll.samples, sparse);
+  EXPECT_EQ(sparseParked.samples, sparse);
+
+  RecordProperty("burst_blocking_p99_us", int(blocking.p99.count()));
+  RecordProperty("burst_busy_poll_p99_us", int(busyPoll.p99.count()));
+  RecordProperty("sparse_blocking_p99_us", int(sparseBlocking.p99.count()));
+  RecordProperty("sparse_busy_poll_p99_us", int(sparseBusyPoll.p99.count()));
+  RecordProperty("sparse_short_spin_p99_us", int(sparseParked.p99.count()));
+}